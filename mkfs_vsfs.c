@@ -0,0 +1,289 @@
+/**
+ * mkfs.vsfs - Very Simple File System Formatter
+ *
+ * This program creates an empty VSFS file system image with a root directory
+ * and /lost+found. Only the metadata blocks that hold something are written;
+ * the rest of the image is left as a hole and reads back as zeros.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#include "vsfs.h"
+
+#define BITMAP_BITS VSFS_BITMAP_BITS  // One bitmap block, less the tail kept for a superblock backup
+#define MIN_DATA_BLOCKS 2             // The root directory and /lost+found
+#define ZERO_CHUNK_BLOCKS 256         // Blocks per write when zeroing a device (1 MiB)
+
+// Layout of the image being formatted
+typedef struct {
+    uint32_t total_blocks;
+    uint32_t inode_count;
+    uint32_t inode_table_start;
+    uint32_t data_block_start;
+} geometry_t;
+
+// Function prototypes
+void usage(const char *prog);
+bool parse_count(const char *arg, uint32_t *value);
+bool compute_geometry(uint32_t total_blocks, uint32_t inode_count, geometry_t *geo);
+bool write_at(int fd, const void *buf, uint32_t block);
+bool zero_blocks(int fd, uint32_t first, uint32_t count);
+int format_image(const char *path, const geometry_t *geo, bool force);
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-b blocks] [-i inodes] [-f] <image>\n", prog);
+    fprintf(stderr, "  -b, --blocks N   Total blocks of %d bytes (only %d is supported)\n", BLOCK_SIZE, TOTAL_BLOCKS);
+    fprintf(stderr, "  -i, --inodes N   Number of inodes (only %d is supported)\n", INODE_COUNT);
+    fprintf(stderr, "  -f, --force      Overwrite an existing non-empty image\n");
+}
+
+bool parse_count(const char *arg, uint32_t *value) {
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' || parsed == 0 || parsed > UINT32_MAX) {
+        return false;
+    }
+    *value = (uint32_t)parsed;
+    return true;
+}
+
+bool compute_geometry(uint32_t total_blocks, uint32_t inode_count, geometry_t *geo) {
+    // vsfsck sizes its tables at build time, so any other image could be formatted but never checked
+    if (total_blocks != TOTAL_BLOCKS || inode_count != INODE_COUNT) {
+        fprintf(stderr, "Error: vsfsck can only check images of %d blocks with %d inodes\n", TOTAL_BLOCKS, INODE_COUNT);
+        return false;
+    }
+    if (inode_count < 2 || inode_count > BITMAP_BITS) {
+        fprintf(stderr, "Error: inode count must be between 2 and %d\n", BITMAP_BITS);
+        return false;
+    }
+    uint32_t table_blocks = (inode_count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    geo->total_blocks = total_blocks;
+    geo->inode_count = inode_count;
+    geo->inode_table_start = 3;
+    geo->data_block_start = geo->inode_table_start + table_blocks;
+
+    // The data bitmap is one block, so it can describe at most BITMAP_BITS data blocks
+    uint64_t max_blocks = (uint64_t)geo->data_block_start + BITMAP_BITS;
+    if (total_blocks < geo->data_block_start + MIN_DATA_BLOCKS || total_blocks > max_blocks) {
+        fprintf(stderr, "Error: %u inodes need between %u and %llu blocks (%llu MiB)\n", inode_count,
+                geo->data_block_start + MIN_DATA_BLOCKS, (unsigned long long)max_blocks,
+                (unsigned long long)(max_blocks * BLOCK_SIZE >> 20));
+        return false;
+    }
+    return true;
+}
+
+bool write_at(int fd, const void *buf, uint32_t block) {
+    ssize_t written = pwrite(fd, buf, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+    if (written != BLOCK_SIZE) {
+        perror("Error writing image");
+        return false;
+    }
+    return true;
+}
+
+bool zero_blocks(int fd, uint32_t first, uint32_t count) {
+    static uint8_t zeros[ZERO_CHUNK_BLOCKS * BLOCK_SIZE];
+    while (count > 0) {
+        uint32_t n = count < ZERO_CHUNK_BLOCKS ? count : ZERO_CHUNK_BLOCKS;
+        size_t length = (size_t)n * BLOCK_SIZE;
+        if (pwrite(fd, zeros, length, (off_t)first * BLOCK_SIZE) != (ssize_t)length) {
+            perror("Error zeroing image");
+            return false;
+        }
+        first += n;
+        count -= n;
+    }
+    return true;
+}
+
+int format_image(const char *path, const geometry_t *geo, bool force) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Error opening image");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error reading image size");
+        close(fd);
+        return -1;
+    }
+    off_t image_size = (off_t)geo->total_blocks * BLOCK_SIZE;
+    bool device = S_ISBLK(st.st_mode);
+    if (!device && st.st_size > 0 && !force) {
+        fprintf(stderr, "Error: %s is not empty (use -f to overwrite it)\n", path);
+        close(fd);
+        return -1;
+    }
+
+    if (device) {
+        // A device keeps its old contents, so the metadata area has to be zeroed explicitly
+        off_t device_size = lseek(fd, 0, SEEK_END);
+        if (device_size < image_size) {
+            fprintf(stderr, "Error: %s is smaller than %u blocks\n", path, geo->total_blocks);
+            close(fd);
+            return -1;
+        }
+        if (!zero_blocks(fd, 0, geo->data_block_start + MIN_DATA_BLOCKS)) {
+            close(fd);
+            return -1;
+        }
+    } else if (ftruncate(fd, 0) != 0 || ftruncate(fd, image_size) != 0) {
+        // Truncating to zero first drops every old block, so the whole image is one hole
+        perror("Error sizing image");
+        close(fd);
+        return -1;
+    }
+
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t root_block = geo->data_block_start;
+    uint32_t lost_found_block = geo->data_block_start + 1;
+
+    superblock_t *superblock = calloc(1, sizeof(superblock_t));
+    uint8_t *bitmap = calloc(1, BLOCK_SIZE);
+    inode_t *table = calloc(INODES_PER_BLOCK, sizeof(inode_t));
+    dir_entry_t *entries = calloc(DIR_ENTRIES_PER_BLOCK, sizeof(dir_entry_t));
+    if (!superblock || !bitmap || !table || !entries) {
+        fprintf(stderr, "Error: out of memory\n");
+        free(superblock);
+        free(bitmap);
+        free(table);
+        free(entries);
+        close(fd);
+        return -1;
+    }
+
+    superblock->magic = MAGIC_NUMBER;
+    superblock->block_size = BLOCK_SIZE;
+    superblock->total_blocks = geo->total_blocks;
+    superblock->inode_bitmap_block = 1;
+    superblock->data_bitmap_block = 2;
+    superblock->inode_table_start = geo->inode_table_start;
+    superblock->data_block_start = geo->data_block_start;
+    superblock->inode_size = INODE_SIZE;
+    superblock->inode_count = geo->inode_count;
+    superblock->max_mount_count = VSFS_DEFAULT_MAX_MOUNT_COUNT;
+    superblock->check_interval = VSFS_DEFAULT_CHECK_INTERVAL;
+    superblock->ext_magic = VSFS_EXT_MAGIC;
+
+    // Inodes 0 and 1 and the first two data blocks are used, in both bitmaps
+    bitmap[0] = 0x03;
+
+    inode_t *root = &table[ROOT_INODE];
+    root->mode = S_IFDIR | 0755;
+    root->nlink = 3;
+    root->atime = root->ctime = root->mtime = now;
+    root->size = 3 * sizeof(dir_entry_t);
+    root->blocks = 1;
+    root->direct_blocks[0] = root_block;
+
+    inode_t *lost_found = &table[ROOT_INODE + 1];
+    lost_found->mode = S_IFDIR | 0700;
+    lost_found->nlink = 2;
+    lost_found->atime = lost_found->ctime = lost_found->mtime = now;
+    lost_found->size = 2 * sizeof(dir_entry_t);
+    lost_found->blocks = 1;
+    lost_found->direct_blocks[0] = lost_found_block;
+
+    bool ok = write_at(fd, superblock, 0) && write_at(fd, bitmap, 1) && write_at(fd, bitmap, 2) &&
+              write_at(fd, table, geo->inode_table_start);
+
+    entries[0].inode = ROOT_INODE;
+    strcpy(entries[0].name, ".");
+    entries[1].inode = ROOT_INODE;
+    strcpy(entries[1].name, "..");
+    entries[2].inode = ROOT_INODE + 1;
+    strcpy(entries[2].name, LOST_FOUND_NAME);
+    ok = ok && write_at(fd, entries, root_block);
+
+    memset(entries, 0, DIR_ENTRIES_PER_BLOCK * sizeof(dir_entry_t));
+    entries[0].inode = ROOT_INODE + 1;
+    strcpy(entries[0].name, ".");
+    entries[1].inode = ROOT_INODE;
+    strcpy(entries[1].name, "..");
+    ok = ok && write_at(fd, entries, lost_found_block);
+
+    free(superblock);
+    free(bitmap);
+    free(table);
+    free(entries);
+    if (ok && fsync(fd) != 0) {
+        perror("Error syncing image");
+        ok = false;
+    }
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"blocks", required_argument, NULL, 'b'},
+        {"inodes", required_argument, NULL, 'i'},
+        {"force", no_argument, NULL, 'f'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    uint32_t total_blocks = TOTAL_BLOCKS;
+    uint32_t inode_count = INODE_COUNT;
+    bool force = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:i:fh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b':
+                if (!parse_count(optarg, &total_blocks)) {
+                    fprintf(stderr, "Error: invalid block count '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'i':
+                if (!parse_count(optarg, &inode_count)) {
+                    fprintf(stderr, "Error: invalid inode count '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                force = true;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    geometry_t geo;
+    if (!compute_geometry(total_blocks, inode_count, &geo)) {
+        return EXIT_FAILURE;
+    }
+    if (format_image(argv[optind], &geo, force) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Formatted %s: %u blocks of %d bytes, %u inodes\n", argv[optind], geo.total_blocks, BLOCK_SIZE,
+           geo.inode_count);
+    printf("  Inode table: blocks %u-%u, data: blocks %u-%u\n", geo.inode_table_start, geo.data_block_start - 1,
+           geo.data_block_start, geo.total_blocks - 1);
+    return EXIT_SUCCESS;
+}
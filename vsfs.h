@@ -0,0 +1,102 @@
+/**
+ * vsfs.h - On-disk format of the Very Simple File System
+ *
+ * Shared by vsfsck and mkfs.vsfs. vsfsck checks images of the standard size,
+ * 64 blocks of 4096 bytes with 80 inodes, normally with the bitmaps in blocks 1
+ * and 2, the inode table in blocks 3-7 and data from block 8.
+ */
+
+#ifndef VSFS_H
+#define VSFS_H
+
+#include <stdint.h>
+
+#define BLOCK_SIZE 4096
+#define TOTAL_BLOCKS 64
+#define INODE_SIZE 256
+#define INODE_COUNT 80  // 5 blocks * 4096 bytes per block / 256 bytes per inode
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
+#define ROOT_INODE 0                   // Inode of the root directory
+#define DIR_NAME_LENGTH 28
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(dir_entry_t))
+#define LOST_FOUND_NAME "lost+found"
+#define MAGIC_NUMBER 0xD34D
+#define VSFS_EXT_MAGIC 0x56534558      // superblock.ext_magic of images whose extended fields are in use
+#define VSFS_BITMAP_TAIL 64            // Bytes at the end of each bitmap block kept for a superblock backup
+#define VSFS_BITMAP_BITS ((BLOCK_SIZE - VSFS_BITMAP_TAIL) * 8)  // Usable bits of a one-block bitmap
+
+// The superblock fields from features to max_mount_count were carved out of reserved space, which
+// older tools did not always zero. They are only trusted when ext_magic holds VSFS_EXT_MAGIC;
+// otherwise the image is read as having no features, no state and no checksums.
+
+// Optional feature flags stored in superblock.features
+#define VSFS_FEATURE_METADATA_CSUM 0x0001  // CRC32C checksums on all metadata blocks
+#define VSFS_FEATURE_SB_BACKUP     0x0002  // Superblock copies in the bitmap block tails
+
+// File system states stored in superblock.state (0 means never checked)
+#define VSFS_STATE_CLEAN  0x0001  // Cleanly closed and consistent at the last check
+#define VSFS_STATE_ERRORS 0x0002  // The last check left errors behind
+
+// A clean image is checked anyway once it has been mounted this often or left this long
+#define VSFS_DEFAULT_MAX_MOUNT_COUNT 20
+#define VSFS_DEFAULT_CHECK_INTERVAL (180 * 86400)  // Seconds
+
+// Superblock structure
+typedef struct {
+    uint16_t magic;              // Magic number (0xD34D)
+    uint32_t block_size;         // Block size (4096)
+    uint32_t total_blocks;       // Total number of blocks (64)
+    uint32_t inode_bitmap_block; // Inode bitmap block number (1)
+    uint32_t data_bitmap_block;  // Data bitmap block number (2)
+    uint32_t inode_table_start;  // Inode table start block number (3)
+    uint32_t data_block_start;   // First data block number (8)
+    uint32_t inode_size;         // Size of each inode (256)
+    uint32_t inode_count;        // Number of inodes
+    uint32_t features;           // Optional feature flags (VSFS_FEATURE_*)
+    uint32_t inode_bitmap_csum;  // CRC32C of the inode bitmap block
+    uint32_t data_bitmap_csum;   // CRC32C of the data bitmap block
+    uint32_t checksum;           // CRC32C of this block, computed with this field zeroed
+    uint16_t state;              // File system state (VSFS_STATE_*)
+    uint16_t mount_count;        // Mounts since the last successful check
+    uint32_t last_check;         // Time of the last successful check
+    uint32_t generation;         // Incremented on every superblock write
+    uint32_t ext_magic;          // VSFS_EXT_MAGIC when the extended fields are in use
+    uint32_t check_interval;     // Seconds between forced checks (0 disables)
+    uint16_t max_mount_count;    // Mounts between forced checks (0 disables)
+    uint8_t reserved[4020];      // Reserved space
+} superblock_t;
+
+// Inode structure
+typedef struct {
+    uint32_t mode;               // File mode
+    uint32_t uid;                // User ID
+    uint32_t gid;                // Group ID
+    uint32_t size;               // File size in bytes
+    uint32_t atime;              // Last access time
+    uint32_t ctime;              // Creation time
+    uint32_t mtime;              // Last modification time
+    uint32_t dtime;              // Deletion time
+    uint32_t nlink;              // Number of hard links
+    uint32_t blocks;             // Number of data blocks
+    uint32_t direct_blocks[12];  // Direct block pointers
+    uint32_t indirect_block;     // Single indirect block pointer
+    uint32_t double_indirect;    // Double indirect block pointer
+    uint32_t triple_indirect;    // Triple indirect block pointer
+    uint32_t indirect_csum;      // CRC32C of the single indirect block
+    uint32_t checksum;           // CRC32C of this inode, computed with this field zeroed
+    uint8_t reserved[148];       // Reserved space
+} inode_t;
+
+_Static_assert(sizeof(superblock_t) == BLOCK_SIZE, "superblock must fill exactly one block");
+_Static_assert(sizeof(inode_t) == INODE_SIZE, "inode size must match INODE_SIZE");
+
+// Directory entry; directories hold size / sizeof(dir_entry_t) slots, and a slot whose name
+// starts with '\0' is free
+typedef struct {
+    uint32_t inode;              // Inode the name refers to
+    char name[DIR_NAME_LENGTH];  // Name, NUL-padded and not terminated when it fills the field
+} dir_entry_t;
+
+_Static_assert(BLOCK_SIZE % sizeof(dir_entry_t) == 0, "directory entries must tile a block");
+
+#endif